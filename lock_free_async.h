@@ -0,0 +1,86 @@
+#ifndef LOCK_FREE_ASYNC_H
+#define LOCK_FREE_ASYNC_H
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <thread>
+
+// Shared pieces of the coroutine front ends (AsyncCircleQueue, AsyncStack). A coroutine that
+// cannot make progress parks its awaiter on a WaiterList under a WaiterLock and retries once
+// after registering, so an element that raced in is never missed. The side that makes
+// progress hands the element or slot straight to the parked awaiter and resumes it inline on
+// its own thread, no thread ever sleeps on the structure.
+
+// spin lock around the waiter lists, only taken on the slow path
+class WaiterLock {
+public:
+	WaiterLock() {
+		waiters_using = false;
+	}
+	// the holder may be preempted inside the short critical section, so yield between tries
+	void lock() {
+		bool use_expected = false;
+		while(!waiters_using.compare_exchange_weak(use_expected, true, std::memory_order_acquire)) {
+			use_expected = false;
+			std::this_thread::yield();
+		}
+	}
+	void unlock() {
+		waiters_using.store(false, std::memory_order_release);
+	}
+private:
+	std::atomic<bool> waiters_using;
+};
+
+// intrusive FIFO of parked awaiters, W links through a W *next member
+template<typename W>
+class WaiterList {
+public:
+	WaiterList(): head(nullptr), tail(nullptr) {}
+	bool empty() {
+		return head == nullptr;
+	}
+	W* front() {
+		return head;
+	}
+	void push_back(W *awaiter) {
+		awaiter->next = nullptr;
+		if(tail) tail->next = awaiter;
+		else head = awaiter;
+		tail = awaiter;
+	}
+	W* pop_front() {
+		W *awaiter = head;
+		head = awaiter->next;
+		if(head == nullptr) tail = nullptr;
+		return awaiter;
+	}
+private:
+	W *head;
+	W *tail;
+};
+
+// resume a chain of awaiters linked through next, next is read first because the resumed
+// coroutine may destroy its awaiter
+template<typename W>
+void resume_all(W *awaiter) {
+	while(awaiter) {
+		W *next = awaiter->next;
+		awaiter->handle.resume();
+		awaiter = next;
+	}
+}
+
+// fire and forget coroutine used by the tests to start producers and consumers
+struct DetachedTask {
+	struct promise_type {
+		DetachedTask get_return_object() { return {}; }
+		std::suspend_never initial_suspend() { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+#endif
@@ -0,0 +1,955 @@
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "lock_free_async.h"
+#include "lock_free_stress.h"
+
+class TestClass {
+public:
+	TestClass(): id(0) {}
+	TestClass(int id): id(id) {}
+	int id;
+};
+
+enum MmapFlags: unsigned {
+	MMAP_DEFAULT = 0,
+	MMAP_HUGE = 1 << 0,		// try MAP_HUGETLB, fall back to a transparent huge page hint
+	MMAP_POPULATE = 1 << 1,	// fault every page in at allocation time
+	MMAP_MIRROR = 1 << 2,	// map the buffer twice back to back, data[capacity + i] aliases data[i]
+};
+
+template<typename T, unsigned flags = MMAP_HUGE | MMAP_POPULATE>
+class MmapAllocator {
+public:
+	using value_type = T;
+	static constexpr bool mirrored = (flags & MMAP_MIRROR) != 0;
+	static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+	MmapAllocator(): base(nullptr), length(0), mapped_length(0) {}
+	MmapAllocator(const MmapAllocator&) = delete;
+	MmapAllocator& operator=(const MmapAllocator&) = delete;
+	~MmapAllocator() {
+		unmap();
+	}
+	T* allocate(size_t n) {
+		if(base != nullptr) throw std::logic_error("mmap allocator already holds a buffer");
+		size_t bytes = n * sizeof(T);
+		size_t page_size = sysconf(_SC_PAGESIZE);
+		if(mirrored) {
+			if(bytes % page_size != 0) throw std::invalid_argument("mirrored ring size must be a multiple of the page size");
+			if(!((flags & MMAP_HUGE) && bytes % huge_page_size == 0 && map_mirror(bytes, true))) {
+				if(!map_mirror(bytes, false)) throw std::bad_alloc();
+			}
+		} else {
+			if(!((flags & MMAP_HUGE) && map_hugetlb(bytes))) {
+				if(!map_anonymous(round_up(bytes, page_size))) throw std::bad_alloc();
+			}
+		}
+		if(flags & MMAP_POPULATE) prefault();
+		return static_cast<T*>(base);
+	}
+	void deallocate(T *p, size_t) {
+		if(p == base) unmap();
+	}
+private:
+	void *base;
+	size_t length;
+	size_t mapped_length;
+
+	static size_t round_up(size_t bytes, size_t align) {
+		return (bytes + align - 1) / align * align;
+	}
+	bool map_hugetlb(size_t bytes) {
+		size_t len = round_up(bytes, huge_page_size);
+		void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(p == MAP_FAILED) return false;
+		base = p;
+		length = len;
+		mapped_length = len;
+		return true;
+	}
+	// map len bytes of anonymous memory starting on a huge page boundary by over-reserving
+	// and trimming both ends, THP and MAP_FIXED hugetlbfs mappings only work on aligned ranges
+	static void* map_aligned(size_t len, int prot) {
+		size_t reserved = len + huge_page_size;
+		void *p = mmap(nullptr, reserved, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(p == MAP_FAILED) return MAP_FAILED;
+		uintptr_t start = reinterpret_cast<uintptr_t>(p);
+		uintptr_t aligned = round_up(start, huge_page_size);
+		size_t head_len = aligned - start;
+		if(head_len) munmap(p, head_len);
+		if(reserved - head_len - len) munmap(reinterpret_cast<void*>(aligned + len), reserved - head_len - len);
+		return reinterpret_cast<void*>(aligned);
+	}
+	bool map_anonymous(size_t bytes) {
+		size_t len = bytes;
+		void *p;
+		if(flags & MMAP_HUGE) {
+			len = round_up(bytes, huge_page_size);
+			p = map_aligned(len, PROT_READ | PROT_WRITE);
+		} else {
+			p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		}
+		if(p == MAP_FAILED) return false;
+#ifdef MADV_HUGEPAGE
+		if(flags & MMAP_HUGE) madvise(p, len, MADV_HUGEPAGE);
+#endif
+		base = p;
+		length = len;
+		mapped_length = len;
+		return true;
+	}
+	bool map_mirror(size_t bytes, bool huge) {
+		unsigned int memfd_flags = MFD_CLOEXEC;
+		if(huge) memfd_flags |= MFD_HUGETLB;
+		int fd = memfd_create("lock_free_ring", memfd_flags);
+		if(fd < 0) return false;
+		if(ftruncate(fd, bytes) != 0) {
+			close(fd);
+			return false;
+		}
+		void *p;
+		if(flags & MMAP_HUGE) p = map_aligned(2 * bytes, PROT_NONE);
+		else p = mmap(nullptr, 2 * bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(p == MAP_FAILED) {
+			close(fd);
+			return false;
+		}
+		char *first = static_cast<char*>(p);
+		char *second = first + bytes;
+		if(mmap(first, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+				|| mmap(second, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+			munmap(p, 2 * bytes);
+			close(fd);
+			return false;
+		}
+		close(fd);
+#ifdef MADV_HUGEPAGE
+		if(!huge && (flags & MMAP_HUGE)) madvise(p, 2 * bytes, MADV_HUGEPAGE);
+#endif
+		base = p;
+		length = bytes;
+		mapped_length = 2 * bytes;
+		return true;
+	}
+	void prefault() {
+		size_t page_size = sysconf(_SC_PAGESIZE);
+		volatile char *p = static_cast<volatile char*>(base);
+		// touch only the first view of a mirror, the second one shares the same pages
+		for(size_t offset = 0; offset < length; offset += page_size) p[offset] = 0;
+	}
+	void unmap() {
+		if(base == nullptr) return;
+		munmap(base, mapped_length);
+		base = nullptr;
+		length = 0;
+		mapped_length = 0;
+	}
+};
+
+template<typename Allocator>
+struct is_mirrored_allocator: std::false_type {};
+
+template<typename T, unsigned flags>
+struct is_mirrored_allocator<MmapAllocator<T, flags>>: std::bool_constant<MmapAllocator<T, flags>::mirrored> {};
+
+// values the lock free ring hands over with a single atomic store and load
+template<typename T>
+concept AtomicSlotValue = std::is_trivially_copyable_v<T> && sizeof(T) <= 8
+	&& std::atomic_ref<T>::is_always_lock_free && std::atomic_ref<T>::required_alignment <= alignof(T);
+
+template<typename T, size_t size, typename Allocator = std::allocator<T>>
+class LockCircleQueue: Allocator {
+public:
+	LockCircleQueue() {
+		data = Allocator::allocate(size + 1);
+		head = 0;
+		tail = 0;
+		capacity = size + 1;
+	}
+	~LockCircleQueue() {
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		while(head != tail) {
+			std::allocator_traits<Allocator>::destroy(static_cast<Allocator&>(*this), data + head);
+			head = (head + 1) % capacity;
+		}
+		Allocator::deallocate(data, capacity);
+	}
+	bool empty() {
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		return head == tail;
+	}
+	bool full() {
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		return (tail + 1) % capacity == head;
+	}
+	bool push(T&& element) {
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		if((tail + 1) % capacity == head) return false;
+		std::allocator_traits<Allocator>::construct(static_cast<Allocator&>(*this), data + tail, std::move(element));
+		tail = (tail + 1) % capacity;
+		return true;
+	}
+	bool pop(T& element) {
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		if(tail == head) return false;
+		element = std::move(data[head]);
+		std::allocator_traits<Allocator>::destroy(static_cast<Allocator&>(*this), data + head);
+		head = (head + 1) % capacity;
+		return true;
+	}
+	size_t pop(T *elements, size_t n) {
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		size_t count = (tail + capacity - head) % capacity;
+		if(n < count) count = n;
+		size_t first = count;
+		// with a mirrored buffer data[head, head + count) is contiguous even across the wrap
+		if(!is_mirrored_allocator<Allocator>::value && head + count > capacity) first = capacity - head;
+		std::move(data + head, data + head + first, elements);
+		std::move(data, data + (count - first), elements + first);
+		std::destroy(data + head, data + head + first);
+		std::destroy(data, data + (count - first));
+		head = (head + count) % capacity;
+		return count;
+	}
+private:
+	size_t head;
+	size_t tail;
+	size_t capacity;
+	T* data;
+	std::mutex queue_mutex;
+};
+
+template<typename T, size_t size, typename Allocator = std::allocator<T>>
+class LockFreeCircleQueueSpin: Allocator {
+public:
+	LockFreeCircleQueueSpin() {
+		capacity = size + 1;
+		head = 0;
+		tail = 0;
+		atomic_using = false;
+		data = Allocator::allocate(capacity);
+	}
+	~LockFreeCircleQueueSpin() {
+		bool use_expected = false;
+		bool use_desired = true;
+		do {
+			use_expected = false;
+			use_desired = true;
+		} while(!atomic_using.compare_exchange_strong(use_expected, use_desired));
+		while(head != tail) {
+			std::allocator_traits<Allocator>::destroy(static_cast<Allocator&>(*this), data + head);
+			head = (head + 1) % capacity;
+		}
+		Allocator::deallocate(data, capacity);
+		do {
+			use_expected = true;
+			use_desired = false;
+		} while(!atomic_using.compare_exchange_strong(use_expected, use_desired));
+	}
+	bool push(T&& element) {
+		bool use_expected = false;
+		bool use_desired = true;
+		do {
+			use_expected = false;
+			use_desired = true;
+		} while(!atomic_using.compare_exchange_strong(use_expected, use_desired));
+		if((tail + 1) % capacity == head) {
+			do {
+				use_expected = true;
+				use_desired = false;
+			} while(!atomic_using.compare_exchange_strong(use_expected, use_desired));
+			return false;
+		}
+		std::allocator_traits<Allocator>::construct(static_cast<Allocator&>(*this), data + tail, std::move(element));
+		tail = (tail + 1) % capacity;
+		do {
+			use_expected = true;
+			use_desired = false;
+		} while(!atomic_using.compare_exchange_strong(use_expected, use_desired));
+		return true;
+	}
+	bool pop(T& element) {
+		bool use_expected = false;
+		bool use_desired = true;
+		do {
+			use_expected = false;
+			use_desired = true;
+		} while(!atomic_using.compare_exchange_strong(use_expected, use_desired));
+		if(tail == head) {
+			do {
+				use_expected = true;
+				use_desired = false;
+			} while(!atomic_using.compare_exchange_strong(use_expected, use_desired));
+			return false;
+		}
+		element = std::move(data[head]);
+		std::allocator_traits<Allocator>::destroy(static_cast<Allocator&>(*this), data + head);
+		head = (head + 1) % capacity;
+		do {
+			use_expected = true;
+			use_desired = false;
+		} while(!atomic_using.compare_exchange_strong(use_expected, use_desired));
+		return true;
+	}
+	bool empty() {
+		bool flag;
+		bool use_expected = false;
+		bool use_desired = true;
+		do {
+			use_expected = false;
+			use_desired = true;
+		} while(!atomic_using.compare_exchange_strong(use_expected, use_desired));
+		if(head == tail) flag = true;
+		else flag = false;
+		do {
+			use_expected = true;
+			use_desired = false;
+		} while(!atomic_using.compare_exchange_strong(use_expected, use_desired));
+		return flag;
+	}
+private:
+	size_t capacity;
+	size_t head;
+	size_t tail;
+	T* data;
+	std::atomic<bool> atomic_using;
+};
+
+template<typename T, size_t size, typename Allocator = std::allocator<T>>
+class LockFreeCircleQueue: Allocator {
+	// pop copies a slot before claiming it and a producer may refill the slot as soon as
+	// head moves on, so no consumer ever owns a slot long enough to move from or destroy it.
+	// head, tail and tail_update count up without wrapping and index data modulo capacity,
+	// so a pop that copied a slot which was refilled meanwhile always fails its head CAS.
+	static_assert(std::is_trivially_copyable<T>::value, "LockFreeCircleQueue elements are copied out speculatively");
+public:
+	LockFreeCircleQueue() {
+		head = 0;
+		tail = 0;
+		tail_update = 0;
+		capacity = size + 1;
+		data = Allocator::allocate(capacity);
+	}
+	~LockFreeCircleQueue() {
+		Allocator::deallocate(data, capacity);
+	}
+	bool push(T&& element) {
+		size_t t;
+		do {
+			t = tail.load();
+			if(t >= head.load() + capacity - 1) return false;
+			LOCK_FREE_FAULT_POINT();
+		} while(!tail.compare_exchange_strong(t, t + 1));
+		if constexpr(AtomicSlotValue<T>) {
+			std::atomic_ref<T>(data[t % capacity]).store(element, std::memory_order_release);
+		} else {
+			data[t % capacity] = element;
+		}
+		LOCK_FREE_FAULT_POINT();
+		// publish in reservation order, an earlier producer may still be writing its slot and
+		// may have been preempted there, so give up the CPU instead of spinning on it
+		size_t tup = t;
+		while(!tail_update.compare_exchange_weak(tup, tup + 1)) {
+			tup = t;
+			std::this_thread::yield();
+		}
+		return true;
+	}
+	bool pop(T& element) {
+		size_t h;
+		do {
+			h = head.load();
+			if(h == tail.load()) return false;
+			if(h == tail_update.load()) return false;
+			if constexpr(AtomicSlotValue<T>) {
+				element = std::atomic_ref<T>(data[h % capacity]).load(std::memory_order_acquire);
+			} else {
+				element = data[h % capacity];
+			}
+			LOCK_FREE_FAULT_POINT();
+		} while(!head.compare_exchange_strong(h, h + 1));
+		return true;
+	}
+	bool empty() {
+		return head.load() == tail.load();
+	}
+private:
+	size_t capacity;
+	T* data;
+	std::atomic<size_t> head;
+	std::atomic<size_t> tail;
+	std::atomic<size_t> tail_update; 
+};
+
+template<typename T>
+class SharedCircleQueue {
+	static_assert(std::is_trivially_copyable<T>::value, "shared queue elements are copied between processes byte for byte");
+	static_assert(std::atomic<size_t>::is_always_lock_free, "shared queue needs address free atomics");
+public:
+	static constexpr uint64_t queue_magic = 0x4c46435155455545;	// "LFCQUEUE"
+	static constexpr uint32_t queue_version = 1;
+	// create a new named segment, the creating side unlinks the name on destruction
+	SharedCircleQueue(const std::string& name, size_t size): name(name), owner(true) {
+		int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if(fd < 0) throw std::runtime_error("shm_open failed: " + name);
+		try {
+			create(fd, size);
+		} catch(...) {
+			close(fd);
+			shm_unlink(name.c_str());
+			throw;
+		}
+		close(fd);
+	}
+	// attach to a named segment created by another process
+	SharedCircleQueue(const std::string& name): name(name), owner(false) {
+		int fd = shm_open(name.c_str(), O_RDWR, 0600);
+		if(fd < 0) throw std::runtime_error("shm_open failed: " + name);
+		try {
+			attach(fd);
+		} catch(...) {
+			close(fd);
+			throw;
+		}
+		close(fd);
+	}
+	// create inside an anonymous descriptor, e.g. memfd_create, shared by fork or SCM_RIGHTS
+	SharedCircleQueue(int fd, size_t size): owner(false) {
+		create(fd, size);
+	}
+	// attach to a descriptor received from the creating process
+	SharedCircleQueue(int fd): owner(false) {
+		attach(fd);
+	}
+	SharedCircleQueue(const SharedCircleQueue&) = delete;
+	SharedCircleQueue& operator=(const SharedCircleQueue&) = delete;
+	~SharedCircleQueue() {
+		munmap(header, mapped_length);
+		if(owner) shm_unlink(name.c_str());
+	}
+	bool push(T&& element) {
+		return push(static_cast<const T&>(element));
+	}
+	bool push(const T& element) {
+		T *slot_data = reserve();
+		if(slot_data == nullptr) return false;
+		*slot_data = element;
+		commit(slot_data);
+		return true;
+	}
+	bool pop(T& element) {
+		const T *slot_data = peek();
+		if(slot_data == nullptr) return false;
+		element = *slot_data;
+		release(slot_data);
+		return true;
+	}
+	// zero copy producer side: claim the next slot, build the message in place inside the
+	// mapping, then commit it. Consumers see the queue as empty at this slot until commit.
+	T* reserve() {
+		size_t t = header->tail.load(std::memory_order_relaxed);
+		Slot *slot;
+		while(true) {
+			slot = slots + t % capacity;
+			size_t sequence = slot->sequence.load(std::memory_order_acquire);
+			if(sequence == t) {
+				LOCK_FREE_FAULT_POINT();
+				if(header->tail.compare_exchange_weak(t, t + 1, std::memory_order_relaxed)) break;
+			} else if(sequence < t) {
+				return nullptr;
+			} else {
+				t = header->tail.load(std::memory_order_relaxed);
+			}
+		}
+		return &slot->data;
+	}
+	void commit(T *element) {
+		Slot *slot = slot_of(element);
+		slot->sequence.store(slot->sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+	// zero copy consumer side: claim the oldest message and read it in place, then release
+	// the slot back to producers
+	const T* peek() {
+		size_t h = header->head.load(std::memory_order_relaxed);
+		Slot *slot;
+		while(true) {
+			slot = slots + h % capacity;
+			size_t sequence = slot->sequence.load(std::memory_order_acquire);
+			if(sequence == h + 1) {
+				LOCK_FREE_FAULT_POINT();
+				if(header->head.compare_exchange_weak(h, h + 1, std::memory_order_relaxed)) break;
+			} else if(sequence < h + 1) {
+				return nullptr;
+			} else {
+				h = header->head.load(std::memory_order_relaxed);
+			}
+		}
+		return &slot->data;
+	}
+	void release(const T *element) {
+		Slot *slot = slot_of(element);
+		slot->sequence.store(slot->sequence.load(std::memory_order_relaxed) - 1 + capacity, std::memory_order_release);
+	}
+	bool empty() {
+		return header->head.load() == header->tail.load();
+	}
+private:
+	// layout of the mapping, every position is an index into slots so the segment
+	// can sit at a different address in each process
+	struct Header {
+		std::atomic<uint64_t> magic;
+		uint32_t version;
+		uint32_t element_size;
+		uint64_t capacity;
+		alignas(64) std::atomic<size_t> head;
+		alignas(64) std::atomic<size_t> tail;
+	};
+	struct Slot {
+		std::atomic<size_t> sequence;
+		T data;
+	};
+	static constexpr size_t slots_offset = (sizeof(Header) + 63) / 64 * 64;
+	std::string name;
+	bool owner;
+	Header *header;
+	Slot *slots;
+	size_t capacity;
+	size_t mapped_length;
+
+	Slot* slot_of(const T *element) {
+		return slots + (reinterpret_cast<const char*>(element) - reinterpret_cast<const char*>(slots)) / sizeof(Slot);
+	}
+	static size_t length_for(size_t capacity) {
+		return slots_offset + capacity * sizeof(Slot);
+	}
+	void map(int fd, size_t length) {
+		void *p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(p == MAP_FAILED) throw std::runtime_error("mmap of shared queue failed");
+		header = static_cast<Header*>(p);
+		slots = reinterpret_cast<Slot*>(static_cast<char*>(p) + slots_offset);
+		mapped_length = length;
+	}
+	void create(int fd, size_t size) {
+		if(size == 0) throw std::invalid_argument("shared queue size must be positive");
+		capacity = size;
+		if(ftruncate(fd, length_for(capacity)) != 0) throw std::runtime_error("ftruncate of shared queue failed");
+		map(fd, length_for(capacity));
+		new (&header->head) std::atomic<size_t>(0);
+		new (&header->tail) std::atomic<size_t>(0);
+		header->version = queue_version;
+		header->element_size = sizeof(T);
+		header->capacity = capacity;
+		for(size_t i = 0; i < capacity; i++) new (&slots[i].sequence) std::atomic<size_t>(i);
+		// magic goes last, attachers treat its absence as "still being created"
+		new (&header->magic) std::atomic<uint64_t>(0);
+		header->magic.store(queue_magic, std::memory_order_release);
+	}
+	void attach(int fd) {
+		struct stat st;
+		if(fstat(fd, &st) != 0) throw std::runtime_error("fstat of shared queue failed");
+		if(static_cast<size_t>(st.st_size) < slots_offset) throw std::runtime_error("shared queue not initialized");
+		map(fd, st.st_size);
+		try {
+			if(header->magic.load(std::memory_order_acquire) != queue_magic) throw std::runtime_error("shared queue not initialized");
+			if(header->version != queue_version) throw std::runtime_error("shared queue version mismatch");
+			if(header->element_size != sizeof(T)) throw std::runtime_error("shared queue element size mismatch");
+			if(header->capacity == 0) throw std::runtime_error("shared queue has no slots");
+			if(length_for(header->capacity) > mapped_length) throw std::runtime_error("shared queue truncated");
+		} catch(...) {
+			munmap(header, mapped_length);
+			throw;
+		}
+		capacity = header->capacity;
+	}
+};
+
+// coroutine front end for a bounded ring: pop_async suspends while the ring is empty and
+// push_async while it is full, see lock_free_async.h. The default LockFreeCircleQueue takes
+// trivially copyable elements, pass LockFreeCircleQueueSpin or LockCircleQueue for others.
+template<typename T, size_t size, typename Queue = LockFreeCircleQueue<T, size>>
+class AsyncCircleQueue {
+public:
+	class PopAwaiter;
+	class PushAwaiter;
+	AsyncCircleQueue(): waiting(0) {}
+	AsyncCircleQueue(const AsyncCircleQueue&) = delete;
+	AsyncCircleQueue& operator=(const AsyncCircleQueue&) = delete;
+	bool push(T&& element) {
+		if(!queue.push(std::move(element))) return false;
+		resume_waiters();
+		return true;
+	}
+	bool pop(T& element) {
+		if(!queue.pop(element)) return false;
+		resume_waiters();
+		return true;
+	}
+	bool empty() {
+		return queue.empty();
+	}
+	PopAwaiter pop_async() {
+		return PopAwaiter(*this);
+	}
+	PushAwaiter push_async(T&& element) {
+		return PushAwaiter(*this, std::move(element));
+	}
+	class PopAwaiter {
+	public:
+		PopAwaiter(AsyncCircleQueue& owner): owner(owner), next(nullptr) {}
+		bool await_ready() {
+			T element;
+			if(!owner.pop(element)) return false;
+			value.emplace(std::move(element));
+			return true;
+		}
+		bool await_suspend(std::coroutine_handle<> h) {
+			handle = h;
+			return owner.suspend_pop(this);
+		}
+		T await_resume() {
+			return std::move(*value);
+		}
+	private:
+		friend class AsyncCircleQueue;
+		friend class WaiterList<PopAwaiter>;
+		friend void resume_all<PopAwaiter>(PopAwaiter*);
+		AsyncCircleQueue& owner;
+		std::optional<T> value;
+		std::coroutine_handle<> handle;
+		PopAwaiter *next;
+	};
+	class PushAwaiter {
+	public:
+		PushAwaiter(AsyncCircleQueue& owner, T&& element): owner(owner), value(std::move(element)), next(nullptr) {}
+		bool await_ready() {
+			return owner.push(std::move(value));
+		}
+		bool await_suspend(std::coroutine_handle<> h) {
+			handle = h;
+			return owner.suspend_push(this);
+		}
+		void await_resume() {}
+	private:
+		friend class AsyncCircleQueue;
+		friend class WaiterList<PushAwaiter>;
+		friend void resume_all<PushAwaiter>(PushAwaiter*);
+		AsyncCircleQueue& owner;
+		T value;
+		std::coroutine_handle<> handle;
+		PushAwaiter *next;
+	};
+private:
+	Queue queue;
+	WaiterLock waiters_lock;
+	std::atomic<size_t> waiting;
+	WaiterList<PopAwaiter> pop_waiters;
+	WaiterList<PushAwaiter> push_waiters;
+
+	// true keeps the coroutine suspended, false means the element arrived while registering
+	bool suspend_pop(PopAwaiter *awaiter) {
+		T element;
+		waiters_lock.lock();
+		waiting.fetch_add(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(queue.pop(element)) {
+			waiting.fetch_sub(1);
+			waiters_lock.unlock();
+			awaiter->value.emplace(std::move(element));
+			resume_waiters();
+			return false;
+		}
+		pop_waiters.push_back(awaiter);
+		waiters_lock.unlock();
+		return true;
+	}
+	bool suspend_push(PushAwaiter *awaiter) {
+		waiters_lock.lock();
+		waiting.fetch_add(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(queue.push(std::move(awaiter->value))) {
+			waiting.fetch_sub(1);
+			waiters_lock.unlock();
+			resume_waiters();
+			return false;
+		}
+		push_waiters.push_back(awaiter);
+		waiters_lock.unlock();
+		return true;
+	}
+	// a handoff to one side can unblock the other, so alternate until neither moves
+	void resume_waiters() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(waiting.load(std::memory_order_relaxed) == 0) return;
+		PopAwaiter *popped = nullptr;
+		PushAwaiter *pushed = nullptr;
+		T element;
+		waiters_lock.lock();
+		bool progress = true;
+		while(progress) {
+			progress = false;
+			while(!pop_waiters.empty() && queue.pop(element)) {
+				PopAwaiter *awaiter = pop_waiters.pop_front();
+				awaiter->value.emplace(std::move(element));
+				awaiter->next = popped;
+				popped = awaiter;
+				waiting.fetch_sub(1);
+				progress = true;
+			}
+			while(!push_waiters.empty() && queue.push(std::move(push_waiters.front()->value))) {
+				PushAwaiter *awaiter = push_waiters.pop_front();
+				awaiter->next = pushed;
+				pushed = awaiter;
+				waiting.fetch_sub(1);
+				progress = true;
+			}
+		}
+		waiters_lock.unlock();
+		resume_all(popped);
+		resume_all(pushed);
+	}
+};
+
+void test_lock_circle_queue() {
+	int n = 100;
+	std::vector<TestClass> vec;
+	for(int i = 0; i < n; i++) vec.emplace_back(TestClass(i));
+	LockCircleQueue<TestClass, 10> queue;
+	std::mutex print_mutex;
+	bool quit = false;
+	auto push_to_queue = [&queue, &print_mutex, &quit](std::vector<TestClass>&& vec) {
+		for(int i = 0; i < vec.size(); i++) {
+			while(queue.push(std::move(vec[i])) == false) {
+				std::unique_lock<std::mutex> lock(print_mutex);
+				std::cout << "push (" << i << "): queue full"<< std::endl;
+			}
+			std::unique_lock<std::mutex> lock(print_mutex);
+			std::cout << "push (" << i << "): finished" << std::endl;
+		}	
+		quit = true;
+	};
+	auto pop_from_queue = [&queue, &print_mutex, &quit]() {
+		TestClass tc;
+		while(!quit || !queue.empty()) {
+			if(queue.empty() == true) {
+				continue;
+			}
+			queue.pop(tc);
+			std::unique_lock<std::mutex> lock(print_mutex);
+			std::cout << "thread " << std::this_thread::get_id() << ": pop (" << tc.id << ") " << std::endl; 
+		}
+		std::unique_lock<std::mutex> lock(print_mutex);
+		std::cout << "thread " << std::this_thread::get_id() << ": quit" << std::endl;
+	};
+	std::vector<std::thread> threads;
+	threads.emplace_back(std::thread(push_to_queue, std::move(vec)));
+	for(int i = 0; i < std::thread::hardware_concurrency() - 1; i++) {
+		threads.emplace_back(std::thread(pop_from_queue));
+	}
+	for(int i = 0; i < threads.size(); i++) threads[i].join();
+}
+
+void test_lock_free_circle_queue() {
+	int n = 100;
+	std::vector<TestClass> vec;
+	for(int i = 0; i < n; i++) vec.emplace_back(TestClass(i));
+	LockFreeCircleQueueSpin<TestClass, 10> queue;
+	std::mutex print_mutex;
+	bool quit = false;
+	auto push_to_queue = [&queue, &print_mutex, &quit](std::vector<TestClass>&& vec) {
+		for(int i = 0; i < vec.size(); i++) {
+			while(queue.push(std::move(vec[i])) == false) {
+				std::unique_lock<std::mutex> lock(print_mutex);
+				std::cout << "push (" << i << "): queue full"<< std::endl;
+			}
+			std::unique_lock<std::mutex> lock(print_mutex);
+			std::cout << "push (" << i << "): finished" << std::endl;
+		}	
+		quit = true;
+	};
+	auto pop_from_queue = [&queue, &print_mutex, &quit]() {
+		TestClass tc;
+		while(!quit || !queue.empty()) {
+			if(queue.empty() == true) {
+				continue;
+			}
+			queue.pop(tc);
+			std::unique_lock<std::mutex> lock(print_mutex);
+			std::cout << "thread " << std::this_thread::get_id() << ": pop (" << tc.id << ") " << std::endl; 
+		}
+		std::unique_lock<std::mutex> lock(print_mutex);
+		std::cout << "thread " << std::this_thread::get_id() << ": quit" << std::endl;
+	};
+	std::vector<std::thread> threads;
+	threads.emplace_back(std::thread(push_to_queue, std::move(vec)));
+	for(int i = 0; i < std::thread::hardware_concurrency() - 1; i++) {
+		threads.emplace_back(std::thread(pop_from_queue));
+	}
+	for(int i = 0; i < threads.size(); i++) threads[i].join();
+}
+bool test_mmap_circle_queue() {
+	constexpr size_t page_ints = 4096 / sizeof(int);
+	LockCircleQueue<int, 4 * page_ints - 1, MmapAllocator<int, MMAP_HUGE | MMAP_POPULATE | MMAP_MIRROR>> queue;
+	std::vector<int> out(4 * page_ints);
+	int next = 0;
+	int expected = 0;
+	for(int round = 0; round < 10; round++) {
+		while(queue.push(std::move(next))) next++;
+		size_t n = queue.pop(out.data(), 3 * page_ints);
+		for(size_t i = 0; i < n; i++) {
+			if(out[i] != expected++) {
+				std::cout << "mmap queue: expected " << expected - 1 << " got " << out[i] << std::endl;
+				return false;
+			}
+		}
+	}
+	std::cout << "mmap queue: ok" << std::endl;
+	return true;
+}
+
+bool test_shared_circle_queue() {
+	const std::string name = "/lock_free_queue_test";
+	const int n = 100000;
+	shm_unlink(name.c_str());
+	SharedCircleQueue<int> queue(name, 1024);
+	pid_t pid = fork();
+	if(pid == 0) {
+		SharedCircleQueue<int> child(name);
+		for(int i = 0; i < n; i++) {
+			int *slot;
+			while((slot = child.reserve()) == nullptr);
+			*slot = i;
+			child.commit(slot);
+		}
+		_exit(0);
+	}
+	int value;
+	bool ok = true;
+	for(int i = 0; i < n; i++) {
+		while(!queue.pop(value));
+		if(value != i) {
+			std::cout << "shared queue: expected " << i << " got " << value << std::endl;
+			ok = false;
+			break;
+		}
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	std::cout << "shared queue: finished" << std::endl;
+	return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void test_async_circle_queue() {
+	constexpr int producers = 4;
+	constexpr int consumers = 4;
+	constexpr int n = 1000;
+	AsyncCircleQueue<int, 10> queue;
+	long long sum = 0;
+	int finished = 0;
+	auto produce = [&queue](int id) -> DetachedTask {
+		for(int i = 0; i < n; i++) co_await queue.push_async(id * n + i);
+	};
+	auto consume = [&queue, &sum, &finished]() -> DetachedTask {
+		for(int i = 0; i < producers * n / consumers; i++) sum += co_await queue.pop_async();
+		finished++;
+	};
+	// consumers park first on the empty queue, producers then fill it past capacity and park too
+	for(int i = 0; i < consumers; i++) consume();
+	for(int i = 0; i < producers; i++) produce(i);
+	long long expected = static_cast<long long>(producers * n) * (producers * n - 1) / 2;
+	std::cout << "async queue: " << finished << " consumers finished, sum " << sum << " expected " << expected << std::endl;
+}
+
+// FIFO: if push(a) finished before push(b) started, b must not be popped entirely before a.
+// Pushes refused as full are not checked.
+bool check_queue_order(std::vector<Element>& elements, std::string& error) {
+	for(size_t a = 0; a < elements.size(); a++) {
+		for(size_t b = a + 1; b < elements.size(); b++) {
+			if(elements[a].push->response < elements[b].push->invoke && elements[b].pop->response < elements[a].pop->invoke) {
+				error = "value " + std::to_string(elements[b].push->value) + " overtook " + std::to_string(elements[a].push->value);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+template<typename Queue>
+bool stress_circle_queue(Queue& queue) {
+	return stress_rounds([&queue](int round, std::vector<Operation>& history, std::string& error) {
+		return record_history(round, history, error,
+			[&queue](long long value) { return queue.push(std::move(value)); },
+			[&queue](long long& value) { return queue.pop(value); });
+	}, check_queue_order);
+}
+
+// drives the coroutine handoff of AsyncCircleQueue rather than its synchronous push/pop
+template<typename Queue>
+bool stress_async_circle_queue(Queue& queue) {
+	return stress_rounds([&queue](int round, std::vector<Operation>& history, std::string& error) {
+		return record_async_history(round, history, error,
+			[&queue](long long value) { return queue.push_async(std::move(value)); },
+			[&queue]() { return queue.pop_async(); });
+	}, check_queue_order);
+}
+
+int main(int argc, char **argv) {
+	if(argc > 1 && strcmp(argv[1], "stress") == 0) {
+		return run_stress(argc, argv, {
+			{"LockCircleQueue", []() {
+				LockCircleQueue<long long, 64> queue;
+				return stress_circle_queue(queue);
+			}},
+			{"LockCircleQueueMmap", []() {
+				LockCircleQueue<long long, 64, MmapAllocator<long long>> queue;
+				return stress_circle_queue(queue);
+			}},
+			// bulk pops that run across the wrap of a mirrored ring, then the usual history
+			{"LockCircleQueueMirror", []() {
+				LockCircleQueue<long long, 4096 / sizeof(long long) - 1, MmapAllocator<long long, MMAP_MIRROR>> queue;
+				return test_mmap_circle_queue() && stress_circle_queue(queue);
+			}},
+			{"LockFreeCircleQueueSpin", []() {
+				LockFreeCircleQueueSpin<long long, 64> queue;
+				return stress_circle_queue(queue);
+			}},
+			{"LockFreeCircleQueue", []() {
+				LockFreeCircleQueue<long long, 64> queue;
+				return stress_circle_queue(queue);
+			}},
+			{"SharedCircleQueue", []() {
+				int fd = memfd_create("lock_free_queue_stress", MFD_CLOEXEC);
+				SharedCircleQueue<long long> queue(fd, 64);
+				close(fd);
+				return stress_circle_queue(queue);
+			}, false},
+			// a forked producer attaches by name and commits in place while this process pops
+			{"SharedCircleQueueProcesses", test_shared_circle_queue},
+			{"AsyncCircleQueue", []() {
+				AsyncCircleQueue<long long, 64> queue;
+				return stress_circle_queue(queue);
+			}},
+			{"AsyncCircleQueueCoroutines", []() {
+				AsyncCircleQueue<long long, 8> queue;
+				return stress_async_circle_queue(queue);
+			}},
+		});
+	}
+	test_lock_free_circle_queue();
+}
@@ -1,4 +1,5 @@
 #include <climits>
+#include <coroutine>
 #include <cstddef>
 #include <iostream>
 #include <atomic>
@@ -11,6 +12,45 @@
 #include <vector>
 #include <chrono>
 #include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include "lock_free_async.h"
+#include "lock_free_stress.h"
+
+// small trivially copyable values live inside the node, everything else behind a shared_ptr
+template<typename T>
+concept InlineValue = std::is_trivially_copyable_v<T> && sizeof(T) <= 16;
+
+template<typename T>
+struct NodeValue {
+	std::shared_ptr<T> ptr;
+	NodeValue(T&& data): ptr(std::make_shared<T>(std::move(data))) {}
+	std::shared_ptr<T> take() {
+		std::shared_ptr<T> ret;
+		ret.swap(ptr);
+		return ret;
+	}
+	void take(T& data) {
+		data = std::move(*ptr);
+		ptr.reset();
+	}
+};
+
+template<InlineValue T>
+struct NodeValue<T> {
+	T value;
+	NodeValue(T&& data): value(data) {}
+	std::shared_ptr<T> take() {
+		return std::make_shared<T>(value);
+	}
+	void take(T& data) {
+		data = value;
+	}
+};
 
 template<typename T>
 class LockFreeStack {
@@ -18,8 +58,12 @@ public:
 	LockFreeStack() {}
 	LockFreeStack(const LockFreeStack&) = delete;
 	LockFreeStack& operator=(const LockFreeStack&) = delete;
-	virtual void push(const T& data) = 0;
+	void push(const T& data) {
+		push(T(data));
+	}
+	virtual void push(T&& data) = 0;
 	virtual std::shared_ptr<T> pop() = 0;
+	virtual bool pop(T& data) = 0;
 	bool empty() {
 		return (this->head.load() == nullptr);
 	}
@@ -28,11 +72,9 @@ public:
 	}
 protected:
 	struct Node {
-		std::shared_ptr<T> data;
+		NodeValue<T> data;
 		Node *next;
-		Node(const T& data) {
-			this->data = std::make_shared<T>(data);
-		}
+		Node(T&& data): data(std::move(data)), next(nullptr) {}
 	};
 	std::atomic<Node*> head;
 	std::atomic<size_t> size_;
@@ -49,37 +91,47 @@ public:
 		this->size_.store(0);
 	}
 	~LockFreeStackCount() {
-		while(pop());
+		while(pop_node([](Node*) {}));
 	}
-	void push(const T& data) {
-		Node *new_node = new Node(data);
+	using LockFreeStack<T>::push;
+	void push(T&& data) {
+		Node *new_node = new Node(std::move(data));
 		while(!this->head.compare_exchange_weak(new_node->next, new_node));
 		this->size_.fetch_add(1);
 	}	
 	std::shared_ptr<T> pop() {
+		std::shared_ptr<T> ret;
+		pop_node([&ret](Node *node) { ret = node->data.take(); });
+		return ret;
+	}
+	bool pop(T& data) {
+		return pop_node([&data](Node *node) { node->data.take(data); });
+	}
+private:
+	std::atomic<int> threads_in_pop;
+	std::atomic<Node*> to_be_deleted;
+	template<typename Take>
+	bool pop_node(Take take) {
 		this->threads_in_pop.fetch_add(1);
 		Node *old_node;
 		do {
 			old_node = this->head.load();
 			if(old_node == nullptr) {
 				this->threads_in_pop.fetch_sub(1);
-				return std::shared_ptr<T>();
+				return false;
 			}
-		} while(!this->head.compare_exchange_weak(old_node, old_node->next));
-		std::shared_ptr<T> ret;
-		if(old_node) {
-			ret.swap(old_node->data);
-			old_node->next = nullptr;
-		}
+			LOCK_FREE_FAULT_POINT();
+		} while(!this->head.compare_exchange_weak(old_node, std::atomic_ref<Node*>(old_node->next).load()));
+		take(old_node);
+		// poppers that lost the race for old_node may still read its next
+		std::atomic_ref<Node*>(old_node->next).store(nullptr);
 		try_delete(old_node);
 		this->size_.fetch_sub(1);
-		return ret;
+		return true;
 	}
-private:
-	std::atomic<int> threads_in_pop;
-	std::atomic<Node*> to_be_deleted;
 	void try_delete(Node *node) {
 		if(this->threads_in_pop.load() == 1) {
+			LOCK_FREE_FAULT_POINT();
 			Node *nodes = to_be_deleted.exchange(nullptr);	
 			if(!--threads_in_pop) {
 				while(nodes != nullptr) {
@@ -105,7 +157,11 @@ private:
 			tail = node;
 			node = node->next;
 		}
-		while(!to_be_deleted.compare_exchange_weak(tail->next, head));
+		std::atomic_ref<Node*> next(tail->next);
+		Node *old_head = to_be_deleted.load();
+		do {
+			next.store(old_head);
+		} while(!to_be_deleted.compare_exchange_weak(old_head, head));
 	}
 };
 
@@ -119,32 +175,48 @@ public:
 		to_be_deleted.store(nullptr);
 	}
 	~LockFreeStackHazardPointer() {
-		while(pop());
+		while(pop_node([](Node*) {}));
 	}
-	void push(const T& data) {
-		Node *new_node = new Node(data);
+	using LockFreeStack<T>::push;
+	void push(T&& data) {
+		Node *new_node = new Node(std::move(data));
 		while(!this->head.compare_exchange_weak(new_node->next, new_node));
 	}	
 	std::shared_ptr<T> pop() {
+		std::shared_ptr<T> ret;
+		pop_node([&ret](Node *node) { ret = node->data.take(); });
+		return ret;
+	}
+	bool pop(T& data) {
+		return pop_node([&data](Node *node) { node->data.take(data); });
+	}
+private:
+	template<typename Take>
+	bool pop_node(Take take) {
 		std::atomic<void*>& hazard_pointer = get_hazard_pointer_for_current_thread();
 		Node *old_head = this->head.load();
 		do {
-			hazard_pointer.store(old_head);	
-		} while(old_head && !this->head.compare_exchange_weak(old_head, old_head->next));
+			// the hazard pointer only protects old_head if head still points at it after the
+			// store, otherwise old_head may already have been popped and deleted
+			Node *protected_head;
+			do {
+				protected_head = old_head;
+				hazard_pointer.store(old_head);
+				LOCK_FREE_FAULT_POINT();
+				old_head = this->head.load();
+			} while(old_head != protected_head);
+		} while(old_head && !this->head.compare_exchange_strong(old_head, std::atomic_ref<Node*>(old_head->next).load()));
 		hazard_pointer.store(nullptr);
-		std::shared_ptr<T> ret = std::shared_ptr<T>();
-		if(old_head) {
-			ret.swap(old_head->data);
-			if(outstanding_hazard_pointer_for(old_head)) {
-				insert_to_delete(old_head);
-			} else {
-				delete old_head;
-			}
-			delete_nodes_with_no_hazard();
+		if(old_head == nullptr) return false;
+		take(old_head);
+		if(outstanding_hazard_pointer_for(old_head)) {
+			insert_to_delete(old_head);
+		} else {
+			delete old_head;
 		}
-		return ret;
+		delete_nodes_with_no_hazard();
+		return true;
 	}
-private:
 	struct HazardPointer {
 		std::atomic<std::thread::id> id;
 		std::atomic<void*> pointer;
@@ -192,9 +264,14 @@ private:
 		}
 		return false;
 	}
+	// a popper that lost the race for node may still read node->next under its hazard
+	// pointer, so the reclaim list links through it atomically
 	void insert_to_delete(Node *node) {
-		node->next = to_be_deleted.load();
-		while(!to_be_deleted.compare_exchange_weak(node->next, node));
+		std::atomic_ref<Node*> next(node->next);
+		Node *old_head = to_be_deleted.load();
+		do {
+			next.store(old_head);
+		} while(!to_be_deleted.compare_exchange_weak(old_head, node));
 	}
 	void delete_nodes_with_no_hazard() {
 		Node *current = to_be_deleted.exchange(nullptr);
@@ -219,11 +296,12 @@ public:
 	LockFreeStackReference() {
 	}
 	~LockFreeStackReference() {
-		while(pop());
+		while(pop_node([](Node*) {}));
 	}
-	void push(const T& data) {
+	using LockFreeStack<T>::push;
+	void push(T&& data) {
 		RefNode new_head;
-		new_head.node_ptr = new Node(data);
+		new_head.node_ptr = new Node(std::move(data));
 		new_head.outer_ref = 1;
 		new_head.node_ptr->next = head.load();
 		while(!head.compare_exchange_weak(new_head.node_ptr->next, new_head));
@@ -234,6 +312,31 @@ public:
 		*/
 	}
 	std::shared_ptr<T> pop() {
+		std::shared_ptr<T> ret;
+		pop_node([&ret](Node *node) { ret = node->data.take(); });
+		return ret;
+	}
+	bool pop(T& data) {
+		return pop_node([&data](Node *node) { node->data.take(data); });
+	}
+private:
+	struct RefNode;
+	struct Node {
+		NodeValue<T> data;
+		std::atomic<int> inner_ref;	
+		RefNode next;	
+		Node(T&& data): data(std::move(data)), inner_ref(0) {}
+	};
+	struct RefNode {
+		Node *node_ptr;
+		int outer_ref;
+		RefNode(): node_ptr(nullptr), outer_ref(1) {}
+		RefNode(T&& data): node_ptr(new Node(std::move(data))), outer_ref(0) {}
+	};
+	std::atomic<RefNode> head;
+
+	template<typename Take>
+	bool pop_node(Take take) {
 		RefNode old_head = head.load();
 		while(true) {
 			RefNode new_head;
@@ -243,15 +346,15 @@ public:
 			} while(!head.compare_exchange_weak(old_head, new_head));
 			old_head = new_head;
 			Node *node_ptr = old_head.node_ptr;
-			if(node_ptr == nullptr) return std::shared_ptr<T>();
+			if(node_ptr == nullptr) return false;
+			LOCK_FREE_FAULT_POINT();
 			if(head.compare_exchange_strong(old_head, node_ptr->next)) {
-				std::shared_ptr<T> ret;
-				ret.swap(node_ptr->data);
+				take(node_ptr);
 				int thread_count = old_head.outer_ref - 2;
 				if(node_ptr->inner_ref.fetch_add(thread_count) == -thread_count) {
 					delete node_ptr;
 				}
-				return ret;	
+				return true;	
 			} else {
 				if(node_ptr->inner_ref.fetch_sub(1) == 1) {
 					delete node_ptr;
@@ -259,21 +362,96 @@ public:
 			}
 		}
 	}
-private:
-	struct RefNode;
-	struct Node {
-		std::shared_ptr<T> data;
-		std::atomic<int> inner_ref;	
-		RefNode next;	
-		Node(const T& data): data(std::make_shared<T>(data)), inner_ref(0) {}
-	};
-	struct RefNode {
-		Node *node_ptr;
-		int outer_ref;
-		RefNode(): node_ptr(nullptr), outer_ref(1) {}
-		RefNode(const T& data): node_ptr(new Node(data)), outer_ref(0) {}
+};
+
+// coroutine front end for a stack: pop_async suspends while the stack is empty, see
+// lock_free_async.h. Pushes never wait because the stack is unbounded.
+template<typename T, typename Stack = LockFreeStackHazardPointer<T>>
+class AsyncStack {
+public:
+	class PopAwaiter;
+	AsyncStack(): waiting(0) {}
+	AsyncStack(const AsyncStack&) = delete;
+	AsyncStack& operator=(const AsyncStack&) = delete;
+	void push(const T& data) {
+		push(T(data));
+	}
+	void push(T&& data) {
+		stack.push(std::move(data));
+		resume_waiters();
+	}
+	bool pop(T& data) {
+		return stack.pop(data);
+	}
+	bool empty() {
+		return stack.empty();
+	}
+	PopAwaiter pop_async() {
+		return PopAwaiter(*this);
+	}
+	class PopAwaiter {
+	public:
+		PopAwaiter(AsyncStack& owner): owner(owner), next(nullptr) {}
+		bool await_ready() {
+			T data;
+			if(!owner.pop(data)) return false;
+			value.emplace(std::move(data));
+			return true;
+		}
+		bool await_suspend(std::coroutine_handle<> h) {
+			handle = h;
+			return owner.suspend_pop(this);
+		}
+		T await_resume() {
+			return std::move(*value);
+		}
+	private:
+		friend class AsyncStack;
+		friend class WaiterList<PopAwaiter>;
+		friend void resume_all<PopAwaiter>(PopAwaiter*);
+		AsyncStack& owner;
+		std::optional<T> value;
+		std::coroutine_handle<> handle;
+		PopAwaiter *next;
 	};
-	std::atomic<RefNode> head;
+private:
+	Stack stack;
+	WaiterLock waiters_lock;
+	std::atomic<size_t> waiting;
+	WaiterList<PopAwaiter> pop_waiters;
+
+	// true keeps the coroutine suspended, false means an element arrived while registering
+	bool suspend_pop(PopAwaiter *awaiter) {
+		T data;
+		waiters_lock.lock();
+		waiting.fetch_add(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(stack.pop(data)) {
+			waiting.fetch_sub(1);
+			waiters_lock.unlock();
+			awaiter->value.emplace(std::move(data));
+			return false;
+		}
+		pop_waiters.push_back(awaiter);
+		waiters_lock.unlock();
+		return true;
+	}
+	void resume_waiters() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(waiting.load(std::memory_order_relaxed) == 0) return;
+		PopAwaiter *popped = nullptr;
+		T data;
+		waiters_lock.lock();
+		while(!pop_waiters.empty() && stack.pop(data)) {
+			PopAwaiter *awaiter = pop_waiters.pop_front();
+			awaiter->value.emplace(std::move(data));
+			awaiter->next = popped;
+			popped = awaiter;
+			waiting.fetch_sub(1);
+		}
+		waiters_lock.unlock();
+		resume_all(popped);
+	}
 };
 
 class TestClass {
@@ -300,21 +478,27 @@ std::default_random_engine TestClass::e(time(nullptr));
 
 template<typename T>
 void test_lock_free_stack(LockFreeStack<T>& stack) {
-	auto thread_to_push = [&stack]() {
-		for(unsigned long long i = 0; i < 1000000; i++) {
+	constexpr unsigned long long n = 1000000;
+	std::atomic<int> pushing;
+	std::atomic<unsigned long long> popped(0);
+	auto thread_to_push = [&stack, &pushing]() {
+		for(unsigned long long i = 0; i < n; i++) {
 			stack.push(TestClass::random_test_class());	
 			//std::this_thread::sleep_for(std::chrono::microseconds(1));
 		}
+		pushing.fetch_sub(1);
 		std::cout << "push finish" << std::endl;
 	};
-	auto thread_to_pop = [&stack](int id) {
-		while(true) {
+	auto thread_to_pop = [&stack, &pushing, &popped](int id) {
+		while(pushing.load() > 0 || !stack.empty()) {
 			auto ret = stack.pop();
-			std::this_thread::sleep_for(std::chrono::microseconds(10));
+			if(ret) popped.fetch_add(1);
+			else std::this_thread::sleep_for(std::chrono::microseconds(10));
 		}
 	};
-	int push_num = std::thread::hardware_concurrency() / 2;
-	int pop_num = std::thread::hardware_concurrency() - push_num;
+	int push_num = std::max(2u, std::thread::hardware_concurrency()) / 2;
+	int pop_num = std::max(2u, std::thread::hardware_concurrency()) - push_num;
+	pushing.store(push_num);
 	std::vector<std::thread> threads;
 	for(int i = 0; i < push_num; i++) {
 		threads.emplace_back(std::thread(thread_to_push));
@@ -325,10 +509,79 @@ void test_lock_free_stack(LockFreeStack<T>& stack) {
 	for(int i = 0; i < threads.size(); i++) {
 		threads[i].join();
 	}
+	std::cout << "popped " << popped.load() << " of " << push_num * n << std::endl;
 }
 
+void test_async_stack() {
+	constexpr int consumers = 8;
+	constexpr int n = 1000;
+	AsyncStack<int> stack;
+	long long sum = 0;
+	int finished = 0;
+	auto consume = [&stack, &sum, &finished]() -> DetachedTask {
+		for(int i = 0; i < n; i++) sum += co_await stack.pop_async();
+		finished++;
+	};
+	for(int i = 0; i < consumers; i++) consume();
+	for(int i = 0; i < consumers * n; i++) stack.push(i);
+	long long expected = static_cast<long long>(consumers * n) * (consumers * n - 1) / 2;
+	std::cout << "async stack: " << finished << " consumers finished, sum " << sum << " expected " << expected << std::endl;
+}
 
-int main() {
+// LIFO: if push(b) ran entirely after push(a) and entirely before pop(a) started, b was above a
+// when a left, so pop(b) must not start after pop(a) finished
+bool check_stack_order(std::vector<Element>& elements, std::string& error) {
+	for(size_t a = 0; a < elements.size(); a++) {
+		for(size_t b = a + 1; b < elements.size(); b++) {
+			auto [push_a, pop_a] = elements[a];
+			auto [push_b, pop_b] = elements[b];
+			if(push_a->response < push_b->invoke && push_b->response < pop_a->invoke && pop_a->response < pop_b->invoke) {
+				error = "value " + std::to_string(push_a->value) + " popped while " + std::to_string(push_b->value) + " was above it";
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool stress_lock_free_stack(LockFreeStack<long long>& stack) {
+	return stress_rounds([&stack](int round, std::vector<Operation>& history, std::string& error) {
+		return record_history(round, history, error,
+			[&stack](long long value) { stack.push(value); return true; },
+			[&stack](long long& value) { return stack.pop(value); });
+	}, check_stack_order);
+}
+
+// pushes never wait, pops go through the coroutine handoff
+bool stress_async_stack(AsyncStack<long long>& stack) {
+	return stress_rounds([&stack](int round, std::vector<Operation>& history, std::string& error) {
+		return record_async_history(round, history, error,
+			[&stack](long long value) { stack.push(value); return std::suspend_never(); },
+			[&stack]() { return stack.pop_async(); });
+	}, check_stack_order);
+}
+
+int main(int argc, char **argv) {
+	if(argc > 1 && strcmp(argv[1], "stress") == 0) {
+		return run_stress(argc, argv, {
+			{"LockFreeStackCount", []() {
+				LockFreeStackCount<long long> stack;
+				return stress_lock_free_stack(stack);
+			}},
+			{"LockFreeStackHazardPointer", []() {
+				LockFreeStackHazardPointer<long long> stack;
+				return stress_lock_free_stack(stack);
+			}},
+			{"LockFreeStackReference", []() {
+				LockFreeStackReference<long long> stack;
+				return stress_lock_free_stack(stack);
+			}},
+			{"AsyncStack", []() {
+				AsyncStack<long long> stack;
+				return stress_async_stack(stack);
+			}},
+		});
+	}
 	LockFreeStackReference<TestClass> stack;
 	stack.push(TestClass::random_test_class());
 }
@@ -0,0 +1,288 @@
+#ifndef LOCK_FREE_STRESS_H
+#define LOCK_FREE_STRESS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "lock_free_async.h"
+
+// build with -DLOCK_FREE_FAULT_INJECTION to stall threads at random between the loads and
+// compare_exchange calls marked with LOCK_FREE_FAULT_POINT, which widens ABA, reclamation
+// and index races
+#ifdef LOCK_FREE_FAULT_INJECTION
+inline void fault_point() {
+	thread_local std::default_random_engine e(std::hash<std::thread::id>()(std::this_thread::get_id()));
+	unsigned r = e() % 64;
+	if(r == 0) std::this_thread::sleep_for(std::chrono::microseconds(e() % 50));
+	else if(r < 8) std::this_thread::yield();
+}
+#define LOCK_FREE_FAULT_POINT() fault_point()
+#else
+#define LOCK_FREE_FAULT_POINT()
+#endif
+
+// Randomized concurrent histories checked offline. Every push carries a unique value and
+// every operation records invoke/response ticks of a shared clock, so "a responded before b
+// was invoked" is exact. The checks look for the known ways a stack or queue goes wrong, they
+// are not a search for a linearization, so a history can pass and still not be linearizable.
+// check_history covers what every container shares: each popped value was pushed, popped
+// once, never before its push, nothing is lost after draining, and, unless the case turns it
+// off, no pop reports empty while some value was provably inside. Each program adds its
+// ordering check.
+//
+//	g++ -std=c++20 -O1 -g -fsanitize=address -pthread lock_free_queue.cpp
+//	g++ -std=c++20 -O1 -g -fsanitize=thread -pthread lock_free_stack.cpp -latomic
+//	add -DLOCK_FREE_FAULT_INJECTION to either, then run ./a.out stress [name]
+struct Operation {
+	bool is_push;
+	bool ok;
+	long long value;
+	unsigned long long invoke;
+	unsigned long long response;
+};
+
+// a successful push and the pop that removed its value
+struct Element {
+	Operation *push;
+	Operation *pop;
+};
+
+inline std::atomic<unsigned long long> history_clock(0);
+
+// cleared by run_isolated for cases whose structure may report empty by design
+inline bool check_empty_pop = true;
+
+// on success elements holds every pushed value sorted by push response
+inline bool check_history(std::vector<Operation>& history, std::vector<Element>& elements, std::string& error) {
+	std::unordered_map<long long, Operation*> pushes;
+	std::unordered_map<long long, Operation*> pops;
+	for(Operation& op: history) {
+		if(!op.ok) continue;
+		if(op.is_push) {
+			pushes[op.value] = &op;
+		} else if(!pops.emplace(op.value, &op).second) {
+			error = "value " + std::to_string(op.value) + " popped twice";
+			return false;
+		}
+	}
+	for(auto& [value, pop]: pops) {
+		auto it = pushes.find(value);
+		if(it == pushes.end()) {
+			error = "value " + std::to_string(value) + " popped but never pushed";
+			return false;
+		}
+		if(pop->response < it->second->invoke) {
+			error = "value " + std::to_string(value) + " popped before it was pushed";
+			return false;
+		}
+	}
+	elements.clear();
+	for(auto& [value, push]: pushes) {
+		auto it = pops.find(value);
+		if(it == pops.end()) {
+			error = "value " + std::to_string(value) + " lost";
+			return false;
+		}
+		elements.push_back(Element{push, it->second});
+	}
+	std::sort(elements.begin(), elements.end(), [](const Element& a, const Element& b) { return a.push->response < b.push->response; });
+	if(!check_empty_pop) return true;
+	std::vector<unsigned long long> latest_pop(elements.size());
+	for(size_t i = 0; i < elements.size(); i++) {
+		latest_pop[i] = std::max(i ? latest_pop[i - 1] : 0, elements[i].pop->invoke);
+	}
+	for(Operation& op: history) {
+		if(op.is_push || op.ok) continue;
+		auto end = std::lower_bound(elements.begin(), elements.end(), op.invoke, [](const Element& e, unsigned long long t) { return e.push->response < t; });
+		size_t before = end - elements.begin();
+		if(before && latest_pop[before - 1] > op.response) {
+			error = "pop reported empty while a value was inside";
+			return false;
+		}
+	}
+	return true;
+}
+
+// at least 4 threads so races happen on small machines, at most 16 because
+// LockFreeStackHazardPointer has a fixed table of 20 per-thread hazard pointers
+inline int stress_thread_num() {
+	return std::clamp(std::thread::hardware_concurrency(), 4u, 16u);
+}
+
+// several threads each run a random mix of push(value) -> bool and pop(value&) -> bool,
+// then the structure is drained from this thread
+template<typename Push, typename Pop>
+bool record_history(int round, std::vector<Operation>& history, std::string&, Push push, Pop pop) {
+	constexpr int ops = 500;
+	int thread_num = stress_thread_num();
+	std::vector<std::vector<Operation>> logs(thread_num);
+	std::vector<std::thread> threads;
+	for(int t = 0; t < thread_num; t++) {
+		threads.emplace_back([&push, &pop, &logs, t, round]() {
+			std::default_random_engine e(round * 1000 + t);
+			for(int i = 0; i < ops; i++) {
+				Operation op;
+				op.is_push = e() % 2;
+				op.value = static_cast<long long>(t) * ops + i;
+				op.invoke = history_clock.fetch_add(1);
+				op.ok = op.is_push ? push(op.value) : pop(op.value);
+				op.response = history_clock.fetch_add(1);
+				logs[t].push_back(op);
+			}
+		});
+	}
+	for(int i = 0; i < threads.size(); i++) threads[i].join();
+	history.clear();
+	for(auto& log: logs) history.insert(history.end(), log.begin(), log.end());
+	Operation op{false, true, 0, 0, 0};
+	while(true) {
+		op.invoke = history_clock.fetch_add(1);
+		op.ok = pop(op.value);
+		op.response = history_clock.fetch_add(1);
+		if(!op.ok) break;
+		history.push_back(op);
+	}
+	return true;
+}
+
+template<typename PushAsync>
+DetachedTask produce_history(PushAsync& push_async, std::vector<Operation>& log, long long first, int ops, std::atomic<int>& finished) {
+	for(int i = 0; i < ops; i++) {
+		Operation op{true, true, first + i, 0, 0};
+		op.invoke = history_clock.fetch_add(1);
+		co_await push_async(op.value);
+		op.response = history_clock.fetch_add(1);
+		log.push_back(op);
+	}
+	finished.fetch_add(1);
+}
+
+template<typename PopAsync>
+DetachedTask consume_history(PopAsync& pop_async, std::vector<Operation>& log, int ops, std::atomic<int>& finished) {
+	for(int i = 0; i < ops; i++) {
+		Operation op{false, true, 0, 0, 0};
+		op.invoke = history_clock.fetch_add(1);
+		op.value = co_await pop_async();
+		op.response = history_clock.fetch_add(1);
+		log.push_back(op);
+	}
+	finished.fetch_add(1);
+}
+
+// several threads each start producer coroutines (co_await push_async(value)) and as many
+// consumer coroutines (value = co_await pop_async()) of the same length, so every parked pop
+// has a matching push. Parked coroutines are resumed inline by whichever thread makes
+// progress, so once the threads are joined any coroutine still unfinished missed its wakeup.
+template<typename PushAsync, typename PopAsync>
+bool record_async_history(int round, std::vector<Operation>& history, std::string& error, PushAsync push_async, PopAsync pop_async) {
+	constexpr int ops = 100;
+	constexpr int coroutines_per_thread = 8;
+	int thread_num = stress_thread_num();
+	int coroutine_num = thread_num * coroutines_per_thread;
+	std::vector<std::vector<Operation>> logs(coroutine_num);
+	std::atomic<int> finished(0);
+	std::vector<std::thread> threads;
+	for(int t = 0; t < thread_num; t++) {
+		threads.emplace_back([&push_async, &pop_async, &logs, &finished, t, round]() {
+			std::default_random_engine e(round * 1000 + t);
+			int producers = 0;
+			int consumers = 0;
+			for(int k = 0; k < coroutines_per_thread; k++) {
+				int id = t * coroutines_per_thread + k;
+				bool produce = consumers == coroutines_per_thread / 2 || (producers < coroutines_per_thread / 2 && e() % 2);
+				if(produce) {
+					producers++;
+					produce_history(push_async, logs[id], static_cast<long long>(id) * ops, ops, finished);
+				} else {
+					consumers++;
+					consume_history(pop_async, logs[id], ops, finished);
+				}
+			}
+		});
+	}
+	for(int i = 0; i < threads.size(); i++) threads[i].join();
+	history.clear();
+	for(auto& log: logs) history.insert(history.end(), log.begin(), log.end());
+	if(finished.load() != coroutine_num) {
+		error = std::to_string(coroutine_num - finished.load()) + " coroutines never resumed";
+		return false;
+	}
+	return true;
+}
+
+// record(round, history, error) -> bool, check_order(elements, error) -> bool
+template<typename Record, typename CheckOrder>
+bool stress_rounds(Record record, CheckOrder check_order) {
+	constexpr int rounds = 20;
+	for(int round = 0; round < rounds; round++) {
+		std::vector<Operation> history;
+		std::vector<Element> elements;
+		std::string error;
+		if(!record(round, history, error) || !check_history(history, elements, error) || !check_order(elements, error)) {
+			std::cout << "round " << round << ": " << error << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+struct StressCase {
+	const char *name;
+	std::function<bool()> run;
+	// false for structures that may report empty while a later push has completed
+	bool check_empty_pop = true;
+};
+
+// run one case in a forked child so a stall or a crash fails that case only, the child is
+// killed by SIGALRM once the time limit passes. The child leaves through exit so sanitizer
+// reports still set its status.
+inline bool run_isolated(const StressCase& c, unsigned seconds) {
+	std::cout.flush();
+	pid_t pid = fork();
+	if(pid < 0) {
+		std::cout << c.name << ": fork failed" << std::endl;
+		return false;
+	}
+	if(pid == 0) {
+		alarm(seconds);
+		check_empty_pop = c.check_empty_pop;
+		std::exit(c.run() ? 0 : 1);
+	}
+	int status;
+	while(waitpid(pid, &status, 0) < 0 && errno == EINTR);
+	if(WIFEXITED(status)) return WEXITSTATUS(status) == 0;
+	if(WTERMSIG(status) == SIGALRM) std::cout << c.name << ": stalled for " << seconds << "s" << std::endl;
+	else std::cout << c.name << ": killed by signal " << WTERMSIG(status) << std::endl;
+	return false;
+}
+
+// ./a.out stress [name] runs every case, or only the one called name
+inline int run_stress(int argc, char **argv, const std::vector<StressCase>& cases) {
+	int run = 0;
+	int passed = 0;
+	for(const StressCase& c: cases) {
+		if(argc > 2 && strcmp(argv[2], c.name) != 0) continue;
+		bool ok = run_isolated(c, 60);
+		std::cout << c.name << ": " << (ok ? "ok" : "failed") << std::endl;
+		run++;
+		if(ok) passed++;
+	}
+	std::cout << passed << " of " << run << " cases passed" << std::endl;
+	return passed == run ? 0 : 1;
+}
+
+#endif